@@ -15,16 +15,26 @@ struct ptx_graph_opts {
     size_t n;   // number bloom filter elements (default 1,000,000)
     double p;   // false positive rate (default 1%)
     int autogc; // automatic gc cycle, set -1 to disable. (default: 1000)
+    int gcbudget; // work per automatic gc step (default: 256)
+    size_t poolsize; // bytes of freed memory kept for reuse (default: 16 MB)
+    bool linearscan; // scan every node instead of using the conflict index
+    bool blocked;    // use cache-line blocked bloom filters (default: false)
+    bool concurrent; // allow operations from many threads (default: false)
 };
 
 PTX_EXTERN struct ptx_graph *ptx_graph_new(struct ptx_graph_opts*);
 PTX_EXTERN void ptx_graph_free(struct ptx_graph *graph);
 PTX_EXTERN void ptx_graph_gc(struct ptx_graph *graph);
+PTX_EXTERN bool ptx_graph_gc_step(struct ptx_graph *graph, size_t budget);
 PTX_EXTERN struct ptx_node *ptx_graph_begin(struct ptx_graph *graph, void *opt);
 PTX_EXTERN void ptx_node_setlabel(struct ptx_node *node, const char *label);
 PTX_EXTERN const char *ptx_node_label(struct ptx_node *node);
 PTX_EXTERN void ptx_node_read(struct ptx_node *node, uint64_t hash);
 PTX_EXTERN void ptx_node_write(struct ptx_node *node, uint64_t hash);
+PTX_EXTERN void ptx_node_read_many(struct ptx_node *node,
+    const uint64_t *hashes, size_t n);
+PTX_EXTERN void ptx_node_write_many(struct ptx_node *node,
+    const uint64_t *hashes, size_t n);
 PTX_EXTERN void ptx_node_rollback(struct ptx_node *node);
 PTX_EXTERN bool ptx_node_commit(struct ptx_node *node);
 PTX_EXTERN bool ptx_oom(void);
@@ -37,11 +47,22 @@ PTX_EXTERN void ptx_graph_print_state(struct ptx_graph *graph, char output[]);
 #include <string.h>
 #include <math.h>
 
-#define PTX_TRACKINS
+#ifndef PTX_NOTHREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define PTX_DEFAULT_N      1000000
 #define PTX_DEFAULT_P      0.01
 #define PTC_DEFAULT_AUTOGC 1000
+#define PTX_DEFAULT_GCBUDGET 256
+#define PTX_DEFAULT_POOLSIZE (16*1024*1024)
 
 #define PTX_ACTIVE     0
 #define PTX_COMMITTED  1
@@ -49,6 +70,10 @@ PTX_EXTERN void ptx_graph_print_state(struct ptx_graph *graph, char output[]);
 #define PTX_NOMEM      3
 #define PTX_RELEASED   4
 
+#define PTX_GC_IDLE  0
+#define PTX_GC_MARK  1
+#define PTX_GC_SWEEP 2
+
 #define PTX_WR 1
 #define PTX_WW 2
 #define PTX_RW 4
@@ -65,6 +90,17 @@ struct ptx_edgemap {
     size_t nbuckets;
 };
 
+// A single bloom filter in a set's chain of growable filters.
+struct ptx_bloom {
+    struct ptx_bloom *next; // the previous, smaller, filter in the chain
+    size_t count;           // number of keys added
+    size_t cap;             // number of keys allowed before adding a filter
+    size_t k;               // number of bits per key
+    size_t m;               // number of bits total
+    bool blocked;           // all bits of a key are in one 64-byte block
+    uint8_t *bits;          // bloom bits (64-byte aligned when blocked)
+};
+
 struct ptx_hashset {
     // hashtable fields
     size_t nbuckets;
@@ -72,44 +108,113 @@ struct ptx_hashset {
     uint64_t *buckets;
     uint64_t buckets0[4]; // 
     // bloom fields
-    size_t k;           // number of bits per key
-    size_t m;           // number of bits total
-    uint8_t *bits;      // bloom bits
+    struct ptx_bloom *bloom; // newest and largest filter, NULL for hashtable
+    bool indexed;            // hashes are in the conflict index
+};
+
+// Conflict index entry. Maps a hash to a node that has read or written it.
+struct ptx_ientry {
+    uint32_t dib;          // bucket distance (robinhood hashtable)
+    uint64_t hash;         // 56-bit hash
+    struct ptx_node *node; // the reader or writer
+};
+
+// Conflict index. A robinhood multimap of hash -> node, for sets that are
+// still in hashtable mode. The graph splits the index into shards by hash.
+struct ptx_index {
+    struct ptx_ientry *buckets;
+    size_t count;
+    size_t nbuckets;
+    bool lock;      // spinlock (concurrent graph only)
+};
+
+#define PTX_NSHARDS 64
+
+// Freed memory that the graph keeps for reuse. Blocks are kept in one list
+// per power of two size, and nodes in a list of their own.
+struct ptx_pool {
+    void *lists[64];
+    struct ptx_node *nodes;
+    size_t size;    // bytes in the lists
+    size_t cap;     // bytes allowed in the lists
+    bool lock;      // spinlock (concurrent graph only)
 };
 
 struct ptx_node {
     struct ptx_node *prev;
     struct ptx_node *next;
     int state;
-    uint64_t ident;
+    uint64_t ident;            // begin sequence
+    uint64_t cseq;             // commit sequence, once committed
     struct ptx_graph *graph;   // root graph
-    bool reached;
+    struct ptx_node *sprev;    // active or committed list
+    struct ptx_node *snext;    // active or committed list
+    bool insq;                 // in the active or committed list
+    bool retired;              // can no longer cause conflicts
+    uint64_t mark;   // gc cycle that last marked this node
     bool nomem;
+    bool released;   // queued to be freed by ptx_node_release
+    struct ptx_node *gcnext; // release queue
 
     bool hasdeps;
     bool hasreads;
     bool haswrites;
+    bool lock;       // spinlock for sets, edges and state (concurrent only)
+    size_t bloomidx; // position+1 in the graph blooms array, or zero
 
 
     struct ptx_edgemap outs;   // Edges that join this node to another.
-#ifdef PTX_TRACKINS
-    struct ptx_edgemap ins; // Edges that join this node to another.
-#endif
+    struct ptx_edgemap ins;    // Edges that join another node to this node.
     struct ptx_hashset reads;
     struct ptx_hashset writes;
     char label[32];
 };
 
+// A list of nodes in sequence order.
+struct ptx_seqlist {
+    struct ptx_node *head;
+    struct ptx_node *tail;
+};
+
 struct ptx_graph {
     struct ptx_node head;
     struct ptx_node tail;
-    uint64_t ident;    // ident counter
+    uint64_t ident;    // ident counter, for begin and commit sequences
+    struct ptx_seqlist active;    // active nodes in begin order
+    struct ptx_seqlist committed; // committed nodes in commit order
     int gccounter;     // gc counter
     int autogc;        //
+    size_t gcbudget;   // work per automatic gc step
+    int gcphase;       // PTX_GC_IDLE, PTX_GC_MARK or PTX_GC_SWEEP
+    uint64_t gcepoch;  // current gc cycle
+    struct ptx_node *gccursor; // next node to scan for roots, or to sweep
+    struct ptx_node **gcstack; // mark stack
+    size_t gcstacklen;
+    size_t gcstackcap;
+    bool gcfailed;     // the mark stack could not grow, abandon the cycle
     void*(*malloc)(size_t);
     void(*free)(void*);
     size_t n;  // number bloom filter elements (default 1,000,000)
     double p;  // false positive rate (default 1%)
+    bool linearscan;         // scan every node for conflicts
+    bool blocked;            // use cache-line blocked bloom filters
+    size_t maxtable;         // hashtable bytes allowed before using a bloom
+    struct ptx_pool pool;    // freed memory for reuse
+    struct ptx_index rindex[PTX_NSHARDS]; // readers by hash
+    struct ptx_index windex[PTX_NSHARDS]; // writers by hash
+    struct ptx_node **blooms; // nodes that have a set in bloom filter mode
+    size_t nblooms;
+    size_t bloomscap;
+    // Concurrent graphs only. The lock order is: gclock, commitlock, then
+    // listlock, bloomlock or an index shard, then a single node lock, and
+    // the pool lock last.
+    bool concurrent;
+    bool listlock;           // spinlock for the node list and counters
+#ifndef PTX_NOTHREADS
+    pthread_rwlock_t gclock; // shared by operations, exclusive to free nodes
+    pthread_rwlock_t bloomlock;  // blooms array
+    pthread_mutex_t commitlock;  // commit validation and state changes
+#endif
 };
 
 static __thread bool _ptx_oom = false;
@@ -118,33 +223,345 @@ bool ptx_oom(void) {
     return _ptx_oom;
 }
 
-static void ptx_hashset_init(struct ptx_hashset *set, size_t n, double p) {
-    memset(set, 0, sizeof(struct ptx_hashset));
-    // Hashtable
-    set->nbuckets = sizeof(set->buckets0)/8;
-    set->buckets = set->buckets0;
-    // Bloom filter
+static void ptx_spin_lock(bool *lock) {
+#ifndef PTX_NOTHREADS
+    while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            sched_yield();
+        }
+    }
+#else
+    (void)lock;
+#endif
+}
+
+static void ptx_spin_unlock(bool *lock) {
+#ifndef PTX_NOTHREADS
+    __atomic_clear(lock, __ATOMIC_RELEASE);
+#else
+    (void)lock;
+#endif
+}
+
+static void ptx_node_lock(struct ptx_graph *graph, struct ptx_node *node) {
+    if (graph->concurrent) {
+        ptx_spin_lock(&node->lock);
+    }
+}
+
+static void ptx_node_unlock(struct ptx_graph *graph, struct ptx_node *node) {
+    if (graph->concurrent) {
+        ptx_spin_unlock(&node->lock);
+    }
+}
+
+static void ptx_graph_lock(struct ptx_graph *graph) {
+    if (graph->concurrent) {
+        ptx_spin_lock(&graph->listlock);
+    }
+}
+
+static void ptx_graph_unlock(struct ptx_graph *graph) {
+    if (graph->concurrent) {
+        ptx_spin_unlock(&graph->listlock);
+    }
+}
+
+// Enter an operation. Nodes are not freed until the operation leaves.
+static void ptx_graph_enter(struct ptx_graph *graph) {
+#ifndef PTX_NOTHREADS
+    if (graph->concurrent) {
+        pthread_rwlock_rdlock(&graph->gclock);
+    }
+#else
+    (void)graph;
+#endif
+}
+
+static void ptx_graph_leave(struct ptx_graph *graph) {
+#ifndef PTX_NOTHREADS
+    if (graph->concurrent) {
+        pthread_rwlock_unlock(&graph->gclock);
+    }
+#else
+    (void)graph;
+#endif
+}
+
+// Enter an operation that must run alone, such as freeing nodes.
+static void ptx_graph_enter_excl(struct ptx_graph *graph) {
+#ifndef PTX_NOTHREADS
+    if (graph->concurrent) {
+        pthread_rwlock_wrlock(&graph->gclock);
+    }
+#else
+    (void)graph;
+#endif
+}
+
+static void ptx_commit_lock(struct ptx_graph *graph) {
+#ifndef PTX_NOTHREADS
+    if (graph->concurrent) {
+        pthread_mutex_lock(&graph->commitlock);
+    }
+#else
+    (void)graph;
+#endif
+}
+
+static void ptx_commit_unlock(struct ptx_graph *graph) {
+#ifndef PTX_NOTHREADS
+    if (graph->concurrent) {
+        pthread_mutex_unlock(&graph->commitlock);
+    }
+#else
+    (void)graph;
+#endif
+}
+
+static void ptx_blooms_lock(struct ptx_graph *graph, bool write) {
+#ifndef PTX_NOTHREADS
+    if (graph->concurrent) {
+        if (write) {
+            pthread_rwlock_wrlock(&graph->bloomlock);
+        } else {
+            pthread_rwlock_rdlock(&graph->bloomlock);
+        }
+    }
+#else
+    (void)graph, (void)write;
+#endif
+}
+
+static void ptx_blooms_unlock(struct ptx_graph *graph) {
+#ifndef PTX_NOTHREADS
+    if (graph->concurrent) {
+        pthread_rwlock_unlock(&graph->bloomlock);
+    }
+#else
+    (void)graph;
+#endif
+}
+
+static void ptx_pool_lock(struct ptx_graph *graph) {
+    if (graph->concurrent) {
+        ptx_spin_lock(&graph->pool.lock);
+    }
+}
+
+static void ptx_pool_unlock(struct ptx_graph *graph) {
+    if (graph->concurrent) {
+        ptx_spin_unlock(&graph->pool.lock);
+    }
+}
+
+// Returns the pool list for blocks of the size, which are 2^class bytes.
+static int ptx_pool_class(size_t size) {
+    if (size <= 16) {
+        return 4;
+    }
+#if defined(__GNUC__) || defined(__clang__)
+    return 64 - __builtin_clzll((unsigned long long)size-1);
+#else
+    int c = 5;
+    while (((size_t)1<<c) < size) {
+        c++;
+    }
+    return c;
+#endif
+}
+
+// Allocate a new block for the pool class.
+// Blocks of 64 bytes or more are aligned to a cache line, with the pointer
+// that was returned by malloc stored just before the block.
+static void *ptx_pool_new(struct ptx_graph *graph, int c) {
+    size_t size = (size_t)1<<c;
+    if (size < 64) {
+        return graph->malloc(size);
+    }
+    uint8_t *mem = graph->malloc(size+64+sizeof(void*));
+    if (!mem) {
+        return 0;
+    }
+    uint8_t *ptr = (uint8_t*)(((uintptr_t)mem+sizeof(void*)+63)&~(uintptr_t)63);
+    ((void**)ptr)[-1] = mem;
+    return ptr;
+}
+
+// Return a block to the allocator.
+static void ptx_pool_release(struct ptx_graph *graph, void *ptr, int c) {
+    if (((size_t)1<<c) < 64) {
+        graph->free(ptr);
+    } else {
+        graph->free(((void**)ptr)[-1]);
+    }
+}
+
+// Allocate memory using the pool.
+// Returns NULL if out of memory.
+static void *ptx_pool_alloc(struct ptx_graph *graph, size_t size) {
+    int c = ptx_pool_class(size);
+    ptx_pool_lock(graph);
+    void *ptr = graph->pool.lists[c];
+    if (ptr) {
+        graph->pool.lists[c] = *(void**)ptr;
+        graph->pool.size -= (size_t)1<<c;
+    }
+    ptx_pool_unlock(graph);
+    return ptr ? ptr : ptx_pool_new(graph, c);
+}
+
+// Free memory that came from ptx_pool_alloc, using the same size.
+// The memory is kept for reuse, unless the pool is full.
+static void ptx_pool_free(struct ptx_graph *graph, void *ptr, size_t size) {
+    int c = ptx_pool_class(size);
+    ptx_pool_lock(graph);
+    if (graph->pool.size + ((size_t)1<<c) <= graph->pool.cap) {
+        *(void**)ptr = graph->pool.lists[c];
+        graph->pool.lists[c] = ptr;
+        graph->pool.size += (size_t)1<<c;
+        ptr = 0;
+    }
+    ptx_pool_unlock(graph);
+    if (ptr) {
+        ptx_pool_release(graph, ptr, c);
+    }
+}
+
+// Allocate a node using the pool.
+static struct ptx_node *ptx_pool_alloc_node(struct ptx_graph *graph) {
+    ptx_pool_lock(graph);
+    struct ptx_node *node = graph->pool.nodes;
+    if (node) {
+        graph->pool.nodes = node->next;
+        graph->pool.size -= sizeof(struct ptx_node);
+    }
+    ptx_pool_unlock(graph);
+    return node ? node : graph->malloc(sizeof(struct ptx_node));
+}
+
+static void ptx_pool_free_node(struct ptx_graph *graph, struct ptx_node *node) {
+    ptx_pool_lock(graph);
+    if (graph->pool.size + sizeof(struct ptx_node) <= graph->pool.cap) {
+        node->next = graph->pool.nodes;
+        graph->pool.nodes = node;
+        graph->pool.size += sizeof(struct ptx_node);
+        node = 0;
+    }
+    ptx_pool_unlock(graph);
+    if (node) {
+        graph->free(node);
+    }
+}
+
+// Return all pooled memory to the allocator.
+static void ptx_pool_clear(struct ptx_graph *graph) {
+    for (int c = 0; c < 64; c++) {
+        while (graph->pool.lists[c]) {
+            void *ptr = graph->pool.lists[c];
+            graph->pool.lists[c] = *(void**)ptr;
+            ptx_pool_release(graph, ptr, c);
+        }
+    }
+    while (graph->pool.nodes) {
+        struct ptx_node *node = graph->pool.nodes;
+        graph->pool.nodes = node->next;
+        graph->free(node);
+    }
+    graph->pool.size = 0;
+}
+
+#define PTX_BLOCKBITS 512 // bits per block, one 64-byte cache line
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PTX_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PTX_PREFETCH(addr) (void)(addr)
+#endif
+
+// Number of hashes to look ahead when prefetching for a batch of probes.
+#define PTX_PREFETCH_DIST 4
+
+// Returns the false positive rate of a blocked bloom filter with n elements,
+// m bits, and k bits per key.
+// The keys are spread over the blocks by a Poisson distribution, with an
+// average of L = n*B/m keys per block, and a block holding i keys behaves like
+// a classic bloom filter of B bits, giving:
+//   fpr = sum[i=0..inf]( (L^i * e^-L / i!) * (1 - (1 - 1/B)^(k*i))^k )
+static double ptx_blocked_fpr(double n, double m, double k) {
+    double B = PTX_BLOCKBITS;
+    double L = n * B / m;
+    if (L > 600) {
+        return 1;
+    }
+    double fpr = 0;
+    double pmf = exp(-L);
+    double end = L + 12 * sqrt(L) + 16;
+    for (double i = 0; i < end; i++) {
+        fpr += pmf * pow(1 - pow(1 - 1 / B, k * i), k);
+        pmf = pmf * L / (i + 1);
+    }
+    return fpr;
+}
+
+// Calculate the number of bits (m) and bits per key (k) for a bloom filter 
+// of n elements and a false positive rate of p. The number of bits is always
+// a power of two.
+static void ptx_bloom_size(size_t n, double p, bool blocked, size_t *m, 
+    size_t *k)
+{
     if (n < 16) {
         n = 16;
     }
+    if (blocked) {
+        *m = PTX_BLOCKBITS;
+        while (1) {
+            // Find the bits per key with the lowest rate for this size.
+            double best = 1;
+            for (size_t i = 1; i <= 16; i++) {
+                double fpr = ptx_blocked_fpr(n, *m, i);
+                if (fpr >= best) {
+                    break;
+                }
+                best = fpr;
+                *k = i;
+            }
+            if (best <= p || *m >= ((size_t)1 << (sizeof(size_t)*8-2))) {
+                break;
+            }
+            *m *= 2;
+        }
+        return;
+    }
     // Calculate the total number of bits needed
-    size_t m = n * log(p) / log(1 / pow(2, log(2)));
+    size_t m0 = n * log(p) / log(1 / pow(2, log(2)));
     // Calculate the bits per key
-    size_t k = round(((double)m / (double)(n)) * log(2));
+    size_t k0 = round(((double)m0 / (double)(n)) * log(2));
     // Adjust the number of bit to power of two
-    set->m = 2;
-    while (set->m < m) {
-        set->m *= 2;
+    *m = 2;
+    while (*m < m0) {
+        *m *= 2;
     }
-    set->k = round((double)m / (double)set->m * (double)k);
+    *k = round((double)m0 / (double)*m * (double)k0);
+    *k = *k < 1 ? 1 : *k;
+}
+
+static void ptx_hashset_init(struct ptx_hashset *set) {
+    memset(set, 0, sizeof(struct ptx_hashset));
+    // Hashtable
+    set->nbuckets = sizeof(set->buckets0)/8;
+    set->buckets = set->buckets0;
 }
 
 static void ptx_hashset_free(struct ptx_graph *graph, struct ptx_hashset *set) {
     if (set->buckets != set->buckets0) {
-        graph->free(set->buckets);
+        ptx_pool_free(graph, set->buckets, set->nbuckets*8);
     }
-    if (set->bits) {
-        graph->free(set->bits);
+    while (set->bloom) {
+        struct ptx_bloom *next = set->bloom->next;
+        ptx_pool_free(graph, set->bloom->bits, set->bloom->m/8);
+        ptx_pool_free(graph, set->bloom, sizeof(struct ptx_bloom));
+        set->bloom = next;
     }
 }
 
@@ -158,22 +575,86 @@ static uint64_t ptx_sethashdib(uint64_t hash, uint8_t dib) {
     return ptx_hashof(hash) | ((uint64_t)dib << 56);
 }
 
-static bool ptx_testadd(struct ptx_hashset *set, uint64_t hash,
+// Returns the block for the hash and fills the mask with the key's bits.
+static uint64_t *ptx_blocked_mask(struct ptx_bloom *bloom, uint64_t hash,
+    uint64_t mask[8])
+{
+    hash = ptx_hashof(hash);
+    uint64_t *block = (uint64_t*)bloom->bits + 
+        (hash & (bloom->m/PTX_BLOCKBITS-1)) * (PTX_BLOCKBITS/64);
+    memset(mask, 0, 64);
+    for (size_t i = 0; i < bloom->k; i++) {
+        if (i % 7 == 0) {
+            // Seven 9-bit positions are taken from each remix of the hash.
+            // This uses part of the mix13 forumula, like ptx_testadd.
+            hash *= UINT64_C(0x94d049bb133111eb);
+            hash ^= hash >> 31;
+        }
+        size_t j = hash & (PTX_BLOCKBITS-1);
+        hash >>= 9;
+        mask[j>>6] |= (uint64_t)1<<(j&63);
+    }
+    return block;
+}
+
+// Returns true if all of the mask bits are set in the block.
+static bool ptx_blocked_probe(const uint64_t block[8], const uint64_t mask[8]) {
+#if defined(__AVX2__)
+    __m256i b0 = _mm256_load_si256((const __m256i*)block);
+    __m256i b1 = _mm256_load_si256((const __m256i*)block+1);
+    __m256i m0 = _mm256_loadu_si256((const __m256i*)mask);
+    __m256i m1 = _mm256_loadu_si256((const __m256i*)mask+1);
+    return _mm256_testc_si256(b0, m0) & _mm256_testc_si256(b1, m1);
+#elif defined(__SSE2__)
+    __m128i x = _mm_setzero_si128();
+    for (int i = 0; i < 4; i++) {
+        __m128i b = _mm_load_si128((const __m128i*)block+i);
+        __m128i m = _mm_loadu_si128((const __m128i*)mask+i);
+        x = _mm_or_si128(x, _mm_andnot_si128(b, m));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) == 0xFFFF;
+#else
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) {
+        x |= mask[i] & ~block[i];
+    }
+    return x == 0;
+#endif
+}
+
+static bool ptx_blocked_testadd(struct ptx_bloom *bloom, uint64_t hash,
     bool add)
 {
+    uint64_t mask[8];
+    uint64_t *block = ptx_blocked_mask(bloom, hash, mask);
+    if (add) {
+        for (int i = 0; i < 8; i++) {
+            block[i] |= mask[i];
+        }
+        return true;
+    }
+    return ptx_blocked_probe(block, mask);
+}
+
+static bool ptx_testadd(struct ptx_bloom *bloom, uint64_t hash,
+    bool add)
+{
+    if (bloom->blocked) {
+        return ptx_blocked_testadd(bloom, hash, add);
+    }
     // We only want the 56-bit hash in order to match correcly with the
     // robinhood entries, upon upgrade.
     hash = ptx_hashof(hash);
     // Add or check each bit
     size_t i = 0;
-    size_t j = hash & (set->m-1);
+    size_t j = hash & (bloom->m-1);
     while (1) {
         if (add) {
-            set->bits[j>>3] |= add<<(j&7);
-        } else if (!((set->bits[j>>3]>>(j&7))&1)) {
+            bloom->bits[j>>3] |= add<<(j&7);
+        } else if (!((bloom->bits[j>>3]>>(j&7))&1)) {
             return false;
         }
-        if (i == set->k-1) {
+        if (i == bloom->k-1) {
             break;
         }
         // Pick the next bit. 
@@ -181,13 +662,14 @@ static bool ptx_testadd(struct ptx_hashset *set, uint64_t hash,
         // https://zimbry.blogspot.com/2011/09/better-bit-mixing-improving-on.html
         hash *= UINT64_C(0x94d049bb133111eb);
         hash ^= hash >> 31;
-        j = hash & (set->m-1);
+        j = hash & (bloom->m-1);
         i++;
     }
     return true;
 }
 
-static void ptx_add0(struct ptx_hashset *set, uint64_t hash) {
+// Returns true if the hash was added, or false if it already exists.
+static bool ptx_add0(struct ptx_hashset *set, uint64_t hash) {
     hash = ptx_hashof(hash);
     uint8_t dib = 1;
     size_t i = hash & (set->nbuckets-1);
@@ -195,7 +677,10 @@ static void ptx_add0(struct ptx_hashset *set, uint64_t hash) {
         if (ptx_dibof(set->buckets[i]) == 0) {
             set->buckets[i] = ptx_sethashdib(hash, dib);
             set->count++;
-            return;
+            return true;
+        }
+        if (ptx_hashof(set->buckets[i]) == hash) {
+            return false;
         }
         if (ptx_dibof(set->buckets[i]) < dib) {
             uint64_t tmp = set->buckets[i];
@@ -203,36 +688,66 @@ static void ptx_add0(struct ptx_hashset *set, uint64_t hash) {
             hash = ptx_hashof(tmp);
             dib = ptx_dibof(tmp);
         }
-        if (ptx_hashof(set->buckets[i]) == hash) {
-            return;
-        }
         dib++;
         i = (i + 1) & (set->nbuckets-1);
     }
 }
 
+// Add a new bloom filter to the front of the set's chain. 
+// Each filter holds twice the keys of the one before it, and is given half
+// of its false positive rate. With a first filter at p/2 the rates of the
+// chain add up to p/2 + p/4 + p/8 ... < p, which bounds the rate of the set.
+// Return true on Success, or false on Out of memory.
+static bool ptx_hashset_addbloom(struct ptx_graph *graph, 
+    struct ptx_hashset *set, size_t cap)
+{
+    double p = graph->p / 2;
+    for (struct ptx_bloom *b = set->bloom; b; b = b->next) {
+        p /= 2;
+    }
+    struct ptx_bloom *bloom = ptx_pool_alloc(graph, sizeof(struct ptx_bloom));
+    if (!bloom) {
+        return false;
+    }
+    memset(bloom, 0, sizeof(struct ptx_bloom));
+    bloom->cap = cap;
+    bloom->blocked = graph->blocked;
+    ptx_bloom_size(cap, p, bloom->blocked, &bloom->m, &bloom->k);
+    // Pool blocks of a cache line or more are aligned, as blocked filters
+    // require.
+    bloom->bits = ptx_pool_alloc(graph, bloom->m/8);
+    if (!bloom->bits) {
+        ptx_pool_free(graph, bloom, sizeof(struct ptx_bloom));
+        return false;
+    }
+    memset(bloom->bits, 0, bloom->m/8);
+    bloom->next = set->bloom;
+    set->bloom = bloom;
+    return true;
+}
+
 static bool ptx_grow(struct ptx_graph *graph, struct ptx_hashset *set) {
     uint64_t *buckets_old = set->buckets;
     size_t nbuckets_old = set->nbuckets;
-    if (set->nbuckets*2*8 >= set->m/8) {
-        // Upgrade to bloom filter
-        set->bits = graph->malloc(set->m/8);
-        if (!set->bits) {
+    if (set->nbuckets*2*8 >= graph->maxtable) {
+        // Upgrade to bloom filter, sized for the keys that the set has now
+        // and room to grow by as many again.
+        if (!ptx_hashset_addbloom(graph, set, set->nbuckets)) {
             return false;
         }
-        set->nbuckets *= 2;
-        memset(set->bits, 0, set->m/8);
         set->count = 0;
         set->nbuckets = 0;
         set->buckets = set->buckets0;
         for (size_t i = 0; i < nbuckets_old; i++) {
             if (ptx_dibof(buckets_old[i])) {
-                ptx_testadd(set, buckets_old[i], true);
+                ptx_testadd(set->bloom, buckets_old[i], true);
+                set->bloom->count++;
             }
         }
     } else {
-        set->buckets = graph->malloc(set->nbuckets*2*8);
-        if (set->buckets) {
+        set->buckets = ptx_pool_alloc(graph, set->nbuckets*2*8);
+        if (!set->buckets) {
+            set->buckets = buckets_old;
             return false;
         }
         set->nbuckets *= 2;
@@ -244,82 +759,493 @@ static bool ptx_grow(struct ptx_graph *graph, struct ptx_hashset *set) {
         }
     }
     if (buckets_old != set->buckets0) {
-        graph->free(buckets_old);
+        ptx_pool_free(graph, buckets_old, nbuckets_old*8);
     }
     return true;
 }
 
+// Returns true if the next add will upgrade the hashtable to a bloom filter.
+static bool ptx_hashset_upgrading(struct ptx_graph *graph, 
+    struct ptx_hashset *set)
+{
+    return !set->bloom && set->count >= set->nbuckets >> 1 && 
+        set->nbuckets*2*8 >= graph->maxtable;
+}
+
+// Add a hash to the set.
+// Returns false if out of memory. The 'added' param is set to true when the
+// hash is new to a hashtable set, which is never the case for a bloom filter.
 static bool ptx_hashset_add(struct ptx_graph *graph, struct ptx_hashset *set,
-    uint64_t hash)
+    uint64_t hash, bool *added)
 {
-    do {
-        if (set->bits) {
-            ptx_testadd(set, hash, true);
+    *added = false;
+    while (1) {
+        if (set->bloom) {
+            if (set->bloom->count == set->bloom->cap) {
+                if (!ptx_hashset_addbloom(graph, set, set->bloom->cap*2)) {
+                    return false;
+                }
+            }
+            ptx_testadd(set->bloom, hash, true);
+            set->bloom->count++;
         } else if (set->count < set->nbuckets >> 1) {
-            ptx_add0(set, hash);
+            *added = ptx_add0(set, hash);
         } else {
             if (!ptx_grow(graph, set)) {
                 return false;
             }
             continue;
         }
-    } while (0);
+        return true;
+    }
+}
+
+static bool ptx_hashset_test(struct ptx_hashset *set, uint64_t hash) {
+    if (set->bloom) {
+        for (struct ptx_bloom *b = set->bloom; b; b = b->next) {
+            if (ptx_testadd(b, hash, false)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    hash = ptx_hashof(hash);
+    uint8_t dib = 1;
+    size_t i = hash & (set->nbuckets-1);
+    while (1) {
+        if (ptx_hashof(set->buckets[i]) == hash) {
+            return true;
+        }
+        if (ptx_dibof(set->buckets[i]) < dib) {
+            return false;
+        }
+        dib++;
+        i = (i + 1) & (set->nbuckets-1);
+    }
+}
+
+// Prefetch the memory that a test for the hash will probe first.
+static void ptx_hashset_prefetch(struct ptx_hashset *set, uint64_t hash) {
+    hash = ptx_hashof(hash);
+    if (!set->bloom) {
+        PTX_PREFETCH(&set->buckets[hash & (set->nbuckets-1)]);
+        return;
+    }
+    for (struct ptx_bloom *b = set->bloom; b; b = b->next) {
+        if (b->blocked) {
+            PTX_PREFETCH((uint64_t*)b->bits + 
+                (hash & (b->m/PTX_BLOCKBITS-1)) * (PTX_BLOCKBITS/64));
+        } else {
+            PTX_PREFETCH(&b->bits[(hash & (b->m-1))>>3]);
+        }
+    }
+}
+
+// Returns true if any of the hashes are in the set.
+// The probes are pipelined by prefetching for the hashes that come next.
+static bool ptx_hashset_testmany(struct ptx_hashset *set, 
+    const uint64_t *hashes, size_t n)
+{
+    for (size_t i = 0; i < n && i < PTX_PREFETCH_DIST; i++) {
+        ptx_hashset_prefetch(set, hashes[i]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (i + PTX_PREFETCH_DIST < n) {
+            ptx_hashset_prefetch(set, hashes[i+PTX_PREFETCH_DIST]);
+        }
+        if (ptx_hashset_test(set, hashes[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if edgemap is empty
+static bool ptx_hashset_empty(struct ptx_hashset *set) {
+    return set->bloom == 0 && set->count == 0;
+}
+
+// Returns the number of items in edgemap
+static size_t ptx_edgemap_count(struct ptx_edgemap *map) {
+    return map->count;
+}
+
+// Free the edgemap
+static void ptx_edgemap_free(struct ptx_graph *graph, struct ptx_edgemap *map) {
+    if (map->buckets) {
+        ptx_pool_free(graph, map->buckets, sizeof(struct ptx_edge)*map->nbuckets);
+    }
+}
+
+// Iterate over all edges. Returns NULL when done.
+// Example:
+//    size_t pidx = 0;
+//    struct ptx_edge *edge = ptx_edgemap_iter(map, &pidx);
+//    while (edge) {
+//         edge = ptx_edgemap_iter(map, &pidx);
+//    }
+static struct ptx_edge *ptx_edgemap_iter(struct ptx_edgemap *map, size_t *pidx){
+    while (1) {
+        if (*pidx >= map->nbuckets) {
+            return 0;
+        }
+        struct ptx_edge *edge = &map->buckets[(*pidx)++];
+        if (edge->dib > 0) {
+            return edge;
+        }
+    }
+}
+
+// Add the entry by performing Robin-hood hashing.
+// This is an intermediate operation and should not be called directly.
+static void ptx_index_insert(struct ptx_index *index, struct ptx_ientry entry) {
+    entry.dib = 1;
+    size_t i = entry.hash & (index->nbuckets-1);
+    while (1) {
+        if (index->buckets[i].dib == 0) {
+            index->buckets[i] = entry;
+            index->count++;
+            return;
+        }
+        if (index->buckets[i].dib < entry.dib) {
+            struct ptx_ientry tmp = index->buckets[i];
+            index->buckets[i] = entry;
+            entry = tmp;
+        }
+        entry.dib++;
+        i = (i + 1) & (index->nbuckets-1);
+    }
+}
+
+// Change the index capacity.
+// Return true on Success, or false on Out of memory.
+static bool ptx_index_resize(struct ptx_graph *graph, struct ptx_index *index,
+    size_t nbuckets1)
+{
+    struct ptx_ientry *buckets0 = index->buckets;
+    size_t nbuckets0 = index->nbuckets;
+    struct ptx_ientry *buckets1 = 
+        ptx_pool_alloc(graph, sizeof(struct ptx_ientry)*nbuckets1);
+    if (!buckets1) {
+        return false;
+    }
+    memset(buckets1, 0, sizeof(struct ptx_ientry)*nbuckets1);
+    index->buckets = buckets1;
+    index->nbuckets = nbuckets1;
+    index->count = 0;
+    for (size_t i = 0; i < nbuckets0; i++) {
+        if (buckets0[i].dib) {
+            ptx_index_insert(index, buckets0[i]);
+        }
+    }
+    if (buckets0) {
+        ptx_pool_free(graph, buckets0, sizeof(struct ptx_ientry)*nbuckets0);
+    }
+    return true;
+}
+
+// Returns the index shard for the hash.
+static struct ptx_index *ptx_graph_index(struct ptx_graph *graph, bool writes,
+    uint64_t hash)
+{
+    // The hashtable buckets use the low bits, the shards use the high bits.
+    size_t i = ptx_hashof(hash) >> (56-6);
+    return writes ? &graph->windex[i] : &graph->rindex[i];
+}
+
+static void ptx_index_lock(struct ptx_graph *graph, struct ptx_index *index) {
+    if (graph->concurrent) {
+        ptx_spin_lock(&index->lock);
+    }
+}
+
+static void ptx_index_unlock(struct ptx_graph *graph, struct ptx_index *index) {
+    if (graph->concurrent) {
+        ptx_spin_unlock(&index->lock);
+    }
+}
+
+// Adds a node to the index using the provided hash.
+// Return true on Success, or false on Out of memory.
+static bool ptx_index_add0(struct ptx_graph *graph, struct ptx_index *index,
+    uint64_t hash, struct ptx_node *node)
+{
+    if (index->count == index->nbuckets / 2) {
+        size_t nbuckets = index->nbuckets == 0 ? 16 : index->nbuckets * 2;
+        if (!ptx_index_resize(graph, index, nbuckets)) {
+            return false;
+        }
+    }
+    struct ptx_ientry entry = {
+        .hash = ptx_hashof(hash),
+        .node = node,
+    };
+    ptx_index_insert(index, entry);
+    return true;
+}
+
+static bool ptx_index_add(struct ptx_graph *graph, bool writes, uint64_t hash,
+    struct ptx_node *node)
+{
+    struct ptx_index *index = ptx_graph_index(graph, writes, hash);
+    ptx_index_lock(graph, index);
+    bool ok = ptx_index_add0(graph, index, hash, node);
+    ptx_index_unlock(graph, index);
+    return ok;
+}
+
+// Deletes a node from the index using the provided hash.
+static void ptx_index_delete0(struct ptx_graph *graph, struct ptx_index *index,
+    uint64_t hash, struct ptx_node *node)
+{
+    if (index->nbuckets == 0) {
+        return;
+    }
+    hash = ptx_hashof(hash);
+    uint32_t dib = 1;
+    size_t i = hash & (index->nbuckets-1);
+    while (1) {
+        if (index->buckets[i].dib < dib) {
+            return;
+        }
+        if (index->buckets[i].hash == hash && index->buckets[i].node == node) {
+            break;
+        }
+        dib++;
+        i = (i + 1) & (index->nbuckets-1);
+    }
+    // Backward shift the following entries.
+    while (1) {
+        index->buckets[i].dib = 0;
+        size_t j = (i + 1) & (index->nbuckets-1);
+        if (index->buckets[j].dib <= 1) {
+            break;
+        }
+        index->buckets[i] = index->buckets[j];
+        index->buckets[i].dib--;
+        i = j;
+    }
+    index->count--;
+    if (index->count == 0) {
+        ptx_pool_free(graph, index->buckets, 
+            sizeof(struct ptx_ientry)*index->nbuckets);
+        index->buckets = 0;
+        index->nbuckets = 0;
+    } else if (index->nbuckets > 16 && index->count < index->nbuckets / 8) {
+        // Shrinking is best effort.
+        ptx_index_resize(graph, index, index->nbuckets / 2);
+    }
+}
+
+static void ptx_index_delete(struct ptx_graph *graph, bool writes,
+    uint64_t hash, struct ptx_node *node)
+{
+    struct ptx_index *index = ptx_graph_index(graph, writes, hash);
+    ptx_index_lock(graph, index);
+    ptx_index_delete0(graph, index, hash, node);
+    ptx_index_unlock(graph, index);
+}
+
+struct ptx_index_iter {
+    uint64_t hash;
+    size_t i;
+    uint32_t dib;
+};
+
+// Iterate over all nodes indexed under the hash. Returns NULL when done.
+// Example:
+//    struct ptx_index_iter iter = ptx_index_iter(index, hash);
+//    struct ptx_node *node = ptx_index_next(index, &iter);
+//    while (node) {
+//         node = ptx_index_next(index, &iter);
+//    }
+static struct ptx_index_iter ptx_index_iter(struct ptx_index *index, 
+    uint64_t hash)
+{
+    hash = ptx_hashof(hash);
+    return (struct ptx_index_iter) {
+        .hash = hash,
+        .i = index->nbuckets == 0 ? 0 : hash & (index->nbuckets-1),
+        .dib = index->nbuckets == 0 ? UINT32_MAX : 1,
+    };
+}
+
+static struct ptx_node *ptx_index_next(struct ptx_index *index,
+    struct ptx_index_iter *iter)
+{
+    while (iter->dib != UINT32_MAX) {
+        struct ptx_ientry *entry = &index->buckets[iter->i];
+        if (entry->dib < iter->dib) {
+            break;
+        }
+        iter->dib++;
+        iter->i = (iter->i + 1) & (index->nbuckets-1);
+        if (entry->hash == iter->hash) {
+            return entry->node;
+        }
+    }
+    iter->dib = UINT32_MAX;
+    return 0;
+}
+
+// Remove all of the hashtable entries of a node's set from the index.
+// Only the thread that owns the node changes its sets, which makes it safe
+// for that thread to read them without locking.
+static void ptx_index_delset(struct ptx_graph *graph, bool writes, 
+    struct ptx_hashset *set, struct ptx_node *node)
+{
+    if (set->bloom) {
+        return;
+    }
+    for (size_t i = 0; i < set->nbuckets; i++) {
+        if (ptx_dibof(set->buckets[i])) {
+            ptx_index_delete(graph, writes, set->buckets[i], node);
+        }
+    }
+}
+
+// Track a node that has a set in bloom filter mode.
+// Return true on Success, or false on Out of memory.
+static bool ptx_graph_addbloom0(struct ptx_graph *graph,
+    struct ptx_node *node)
+{
+    if (node->bloomidx) {
+        return true;
+    }
+    if (graph->nblooms == graph->bloomscap) {
+        size_t cap = graph->bloomscap == 0 ? 16 : graph->bloomscap * 2;
+        struct ptx_node **blooms = 
+            ptx_pool_alloc(graph, sizeof(struct ptx_node*)*cap);
+        if (!blooms) {
+            return false;
+        }
+        if (graph->blooms) {
+            memcpy(blooms, graph->blooms, 
+                sizeof(struct ptx_node*)*graph->nblooms);
+            ptx_pool_free(graph, graph->blooms, 
+                sizeof(struct ptx_node*)*graph->bloomscap);
+        }
+        graph->blooms = blooms;
+        graph->bloomscap = cap;
+    }
+    graph->blooms[graph->nblooms++] = node;
+    node->bloomidx = graph->nblooms;
     return true;
 }
 
-static bool ptx_hashset_test(struct ptx_hashset *set, uint64_t hash) {
-    if (set->bits) {
-        return ptx_testadd(set, hash, false);
+static bool ptx_graph_addbloom(struct ptx_graph *graph, struct ptx_node *node) {
+    ptx_blooms_lock(graph, true);
+    bool ok = ptx_graph_addbloom0(graph, node);
+    ptx_blooms_unlock(graph);
+    return ok;
+}
+
+static void ptx_graph_delbloom0(struct ptx_graph *graph, 
+    struct ptx_node *node)
+{
+    if (!node->bloomidx) {
+        return;
     }
-    hash = ptx_hashof(hash);
-    uint8_t dib = 1;
-    size_t i = hash & (set->nbuckets-1);
-    while (1) {
-        if (ptx_hashof(set->buckets[i]) == hash) {
-            return true;
-        }
-        if (ptx_dibof(set->buckets[i]) < dib) {
-            return false;
-        }
-        dib++;
-        i = (i + 1) & (set->nbuckets-1);
+    struct ptx_node *last = graph->blooms[--graph->nblooms];
+    graph->blooms[node->bloomidx-1] = last;
+    last->bloomidx = node->bloomidx;
+    node->bloomidx = 0;
+    if (graph->nblooms == 0) {
+        ptx_pool_free(graph, graph->blooms, 
+            sizeof(struct ptx_node*)*graph->bloomscap);
+        graph->blooms = 0;
+        graph->bloomscap = 0;
     }
 }
 
-// Returns true if edgemap is empty
-static bool ptx_hashset_empty(struct ptx_hashset *set) {
-    return set->bits == 0 && set->count == 0;
+static void ptx_graph_delbloom(struct ptx_graph *graph, struct ptx_node *node) {
+    ptx_blooms_lock(graph, true);
+    ptx_graph_delbloom0(graph, node);
+    ptx_blooms_unlock(graph);
 }
 
-// Returns the number of items in edgemap
-static size_t ptx_edgemap_count(struct ptx_edgemap *map) {
-    return map->count;
+// Take a node's set out of the conflict index.
+static void ptx_node_unindexset(struct ptx_node *node, struct ptx_hashset *set,
+    bool writes)
+{
+    struct ptx_graph *graph = node->graph;
+    if (set->indexed) {
+        ptx_node_lock(graph, node);
+        set->indexed = false;
+        ptx_node_unlock(graph, node);
+        ptx_index_delset(graph, writes, set, node);
+    }
 }
 
-// Free the edgemap
-static void ptx_edgemap_free(struct ptx_graph *graph, struct ptx_edgemap *map) {
-    if (map->buckets) {
-        graph->free(map->buckets);
+// Remove the node from the conflict index.
+// The node will no longer be found when other nodes search for conflicts.
+static void ptx_node_unindex(struct ptx_node *node) {
+    ptx_node_unindexset(node, &node->reads, false);
+    ptx_node_unindexset(node, &node->writes, true);
+    ptx_graph_delbloom(node->graph, node);
+}
+
+// Add a hash to one of the node's sets, keeping the conflict index in sync.
+// Returns false if out of memory.
+static bool ptx_node_record(struct ptx_node *node, struct ptx_hashset *set,
+    bool writes, uint64_t hash)
+{
+    struct ptx_graph *graph = node->graph;
+    if (set->indexed && ptx_hashset_upgrading(graph, set)) {
+        // The set is about to become a bloom filter, which cannot be indexed
+        // by hash. Move the node over to the blooms array before its entries
+        // leave the index, so that other nodes can always find it.
+        if (!ptx_graph_addbloom(graph, node)) {
+            return false;
+        }
+        ptx_node_unindexset(node, set, writes);
+    }
+    bool added;
+    ptx_node_lock(graph, node);
+    bool ok = ptx_hashset_add(graph, set, hash, &added);
+    ptx_node_unlock(graph, node);
+    if (!ok) {
+        return false;
+    }
+    if (added && set->indexed) {
+        if (!ptx_index_add(graph, writes, hash, node)) {
+            return false;
+        }
     }
+    return true;
 }
 
-// Iterate over all edges. Returns NULL when done.
-// Example:
-//    size_t pidx = 0;
-//    struct ptx_edge *edge = ptx_edgemap_iter(map, &pidx);
-//    while (edge) {
-//         edge = ptx_edgemap_iter(map, &pidx);
-//    }
-static struct ptx_edge *ptx_edgemap_iter(struct ptx_edgemap *map, size_t *pidx){
+// Deletes an edge from the map.
+static void ptx_edgemap_delete(struct ptx_edgemap *map, struct ptx_node *node,
+    int kind)
+{
+    if (map->nbuckets == 0) {
+        return;
+    }
+    uint16_t dib = 1;
+    size_t i = node->ident & (map->nbuckets-1);
     while (1) {
-        if (*pidx >= map->nbuckets) {
-            return 0;
+        if (map->buckets[i].dib < dib) {
+            return;
         }
-        struct ptx_edge *edge = &map->buckets[(*pidx)++];
-        if (edge->dib > 0) {
-            return edge;
+        if (map->buckets[i].node == node && map->buckets[i].kind == kind) {
+            break;
         }
+        dib++;
+        i = (i + 1) & (map->nbuckets-1);
+    }
+    // Backward shift the following edges.
+    while (1) {
+        map->buckets[i].dib = 0;
+        size_t j = (i + 1) & (map->nbuckets-1);
+        if (map->buckets[j].dib <= 1) {
+            break;
+        }
+        map->buckets[i] = map->buckets[j];
+        map->buckets[i].dib--;
+        i = j;
     }
+    map->count--;
 }
 
 struct ptx_graph *ptx_graph_new(struct ptx_graph_opts *opts) {
@@ -328,11 +1254,15 @@ struct ptx_graph *ptx_graph_new(struct ptx_graph_opts *opts) {
     size_t n = opts ? opts->n : 0;
     double p = opts ? opts->p : 0;
     int autogc = opts ? opts->autogc : 0;
+    int gcbudget = opts ? opts->gcbudget : 0;
+    size_t poolsize = opts ? opts->poolsize : 0;
     _malloc = _malloc ? _malloc : malloc;
     _free = _free ? _free : free;
     n = n > 0 ? n : PTX_DEFAULT_N;
     p = p > 0 && isfinite(p) ? p : PTX_DEFAULT_P;
-    autogc = autogc > 0 ? autogc : PTC_DEFAULT_AUTOGC;
+    autogc = autogc != 0 ? autogc : PTC_DEFAULT_AUTOGC;
+    gcbudget = gcbudget > 0 ? gcbudget : PTX_DEFAULT_GCBUDGET;
+    poolsize = poolsize > 0 ? poolsize : PTX_DEFAULT_POOLSIZE;
     struct ptx_graph *graph = _malloc(sizeof(struct ptx_graph));
     if (!graph) {
         return 0;
@@ -342,11 +1272,64 @@ struct ptx_graph *ptx_graph_new(struct ptx_graph_opts *opts) {
     graph->free = _free;
     graph->n = n;
     graph->p = p;
+    graph->autogc = autogc;
+    graph->gcbudget = gcbudget;
+    graph->pool.cap = poolsize;
+    graph->linearscan = opts ? opts->linearscan : false;
+    graph->blocked = opts ? opts->blocked : false;
+    // Sets stay exact until their hashtable would outsize a single bloom
+    // filter that is sized for n elements.
+    size_t m, k;
+    ptx_bloom_size(n, p, graph->blocked, &m, &k);
+    graph->maxtable = m/8;
     graph->head.next = &graph->tail;
     graph->tail.prev = &graph->head;
+#ifndef PTX_NOTHREADS
+    graph->concurrent = opts ? opts->concurrent : false;
+    if (graph->concurrent) {
+        pthread_rwlock_init(&graph->gclock, 0);
+        pthread_rwlock_init(&graph->bloomlock, 0);
+        pthread_mutex_init(&graph->commitlock, 0);
+    }
+#endif
     return graph;
 }
 
+static void ptx_seqlist_push(struct ptx_seqlist *list, struct ptx_node *node) {
+    node->sprev = list->tail;
+    node->snext = 0;
+    if (list->tail) {
+        list->tail->snext = node;
+    } else {
+        list->head = node;
+    }
+    list->tail = node;
+    node->insq = true;
+}
+
+static void ptx_seqlist_remove(struct ptx_seqlist *list, struct ptx_node *node) {
+    if (node->sprev) {
+        node->sprev->snext = node->snext;
+    } else {
+        list->head = node->snext;
+    }
+    if (node->snext) {
+        node->snext->sprev = node->sprev;
+    } else {
+        list->tail = node->sprev;
+    }
+    node->sprev = 0;
+    node->snext = 0;
+    node->insq = false;
+}
+
+// Returns the begin sequence of the oldest active node. A node that committed
+// before this can no longer conflict with any active node, because the
+// active nodes never overlapped with it.
+static uint64_t ptx_graph_watermark(struct ptx_graph *graph) {
+    return graph->active.head ? graph->active.head->ident : UINT64_MAX;
+}
+
 static void ptx_node_unlink(struct ptx_node *node) {
     if (node->prev) {
         node->prev->next = node->next;
@@ -357,16 +1340,39 @@ static void ptx_node_unlink(struct ptx_node *node) {
     node->graph = 0;
 }
 
+// Remove all edges that join other nodes to this node.
+static void ptx_node_detach(struct ptx_node *node) {
+    size_t pidx = 0;
+    struct ptx_edge *edge = ptx_edgemap_iter(&node->outs, &pidx);
+    while (edge) {
+        ptx_edgemap_delete(&edge->node->ins, node, edge->kind);
+        edge = ptx_edgemap_iter(&node->outs, &pidx);
+    }
+    pidx = 0;
+    edge = ptx_edgemap_iter(&node->ins, &pidx);
+    while (edge) {
+        ptx_edgemap_delete(&edge->node->outs, node, edge->kind);
+        edge = ptx_edgemap_iter(&node->ins, &pidx);
+    }
+}
+
 static void ptx_node_free(struct ptx_node *node) {
     struct ptx_graph *graph = node->graph;
+    if (graph->gccursor == node) {
+        graph->gccursor = node->next;
+    }
+    if (node->insq) {
+        ptx_seqlist_remove(node->state == PTX_COMMITTED ? &graph->committed :
+            &graph->active, node);
+    }
+    ptx_node_unindex(node);
+    ptx_node_detach(node);
     ptx_node_unlink(node);
     ptx_hashset_free(graph, &node->reads);
     ptx_hashset_free(graph, &node->writes);
-#ifdef PTX_TRACKINS
     ptx_edgemap_free(graph, &node->ins);
-#endif
     ptx_edgemap_free(graph, &node->outs);
-    graph->free(node);
+    ptx_pool_free_node(graph, node);
 }
 
 void ptx_graph_free(struct ptx_graph *graph) {
@@ -379,68 +1385,246 @@ void ptx_graph_free(struct ptx_graph *graph) {
         if (node->state == PTX_ACTIVE) {
             node->state = PTX_RELEASED;
         }
+        node->reads.indexed = false;
+        node->writes.indexed = false;
+        node->bloomidx = 0;
     }
+    for (int i = 0; i < PTX_NSHARDS; i++) {
+        struct ptx_index *index = &graph->rindex[i];
+        if (index->buckets) {
+            ptx_pool_free(graph, index->buckets, 
+                sizeof(struct ptx_ientry)*index->nbuckets);
+        }
+        index = &graph->windex[i];
+        if (index->buckets) {
+            ptx_pool_free(graph, index->buckets, 
+                sizeof(struct ptx_ientry)*index->nbuckets);
+        }
+    }
+    if (graph->blooms) {
+        ptx_pool_free(graph, graph->blooms, 
+            sizeof(struct ptx_node*)*graph->bloomscap);
+    }
+    ptx_pool_clear(graph);
+    if (graph->gcstack) {
+        graph->free(graph->gcstack);
+    }
+#ifndef PTX_NOTHREADS
+    if (graph->concurrent) {
+        pthread_rwlock_destroy(&graph->gclock);
+        pthread_rwlock_destroy(&graph->bloomlock);
+        pthread_mutex_destroy(&graph->commitlock);
+    }
+#endif
     graph->free(graph);
 }
 
 
-static void ptx_node_gcmark(struct ptx_node *node) {
-    if (!node->reached) {
-        node->reached = true;
+// Returns true if the node has not been committed or rolled back yet.
+// These are the roots of the garbage collector.
+static bool ptx_node_live(struct ptx_node *node) {
+    return node->state == PTX_ACTIVE || node->state == PTX_NOMEM;
+}
+
+// Returns true if the node must be kept, which is when it's live or when it
+// committed after an active node began. These are the roots of the garbage
+// collector.
+static bool ptx_node_needed(struct ptx_node *node) {
+    return ptx_node_live(node) || (node->state == PTX_COMMITTED && 
+        !node->retired && node->cseq >= ptx_graph_watermark(node->graph));
+}
+
+// Returns true if the node was marked by the current gc cycle.
+static bool ptx_node_marked(struct ptx_node *node) {
+    return node->mark == node->graph->gcepoch;
+}
+
+// Mark a node and push it on the mark stack so its edges are scanned later.
+static void ptx_graph_shade(struct ptx_graph *graph, struct ptx_node *node) {
+    if (ptx_node_marked(node)) {
+        return;
+    }
+    node->mark = graph->gcepoch;
+    if (graph->gcstacklen == graph->gcstackcap) {
+        size_t cap = graph->gcstackcap == 0 ? 64 : graph->gcstackcap * 2;
+        struct ptx_node **stack = graph->malloc(sizeof(struct ptx_node*)*cap);
+        if (!stack) {
+            graph->gcfailed = true;
+            return;
+        }
+        if (graph->gcstack) {
+            memcpy(stack, graph->gcstack, 
+                sizeof(struct ptx_node*)*graph->gcstacklen);
+            graph->free(graph->gcstack);
+        }
+        graph->gcstack = stack;
+        graph->gcstackcap = cap;
+    }
+    graph->gcstack[graph->gcstacklen++] = node;
+}
+
+// Free a node, and then any nodes that are left without in-edges and can no
+// longer be reached by the garbage collector.
+static void ptx_node_release(struct ptx_node *node) {
+    struct ptx_graph *graph = node->graph;
+    node->released = true;
+    node->gcnext = 0;
+    while (node) {
+        ptx_node_detach(node);
         size_t pidx = 0;
         struct ptx_edge *edge = ptx_edgemap_iter(&node->outs, &pidx);
         while (edge) {
-            ptx_node_gcmark(edge->node);
+            struct ptx_node *other = edge->node;
+            // Marked nodes may be on the mark stack and are left to the sweep.
+            if (!other->released && !ptx_node_needed(other) && 
+                ptx_edgemap_count(&other->ins) == 0 &&
+                !(graph->gcphase == PTX_GC_MARK && ptx_node_marked(other)))
+            {
+                other->released = true;
+                other->gcnext = node->gcnext;
+                node->gcnext = other;
+            }
             edge = ptx_edgemap_iter(&node->outs, &pidx);
         }
+        struct ptx_node *next = node->gcnext;
+        ptx_node_free(node);
+        node = next;
     }
 }
 
-void ptx_graph_gc(struct ptx_graph *graph) {
-    // Mark. Look for reached nodes.
-    struct ptx_node *node = graph->head.next;
-    while (node != &graph->tail) {
-        if (node->state == PTX_ACTIVE) {
-            ptx_node_gcmark(node);
+// Retire a committed node that can no longer conflict with an active node.
+static void ptx_node_retire(struct ptx_node *node) {
+    struct ptx_graph *graph = node->graph;
+    ptx_seqlist_remove(&graph->committed, node);
+    node->retired = true;
+    if (!(graph->gcphase == PTX_GC_MARK && ptx_node_marked(node))) {
+        ptx_node_release(node);
+        return;
+    }
+    // The node may be on the mark stack, so only cut it loose from the graph
+    // and leave the rest to the sweep.
+    ptx_node_unindex(node);
+    ptx_node_detach(node);
+    ptx_edgemap_free(graph, &node->ins);
+    ptx_edgemap_free(graph, &node->outs);
+    memset(&node->ins, 0, sizeof(struct ptx_edgemap));
+    memset(&node->outs, 0, sizeof(struct ptx_edgemap));
+}
+
+// Retire the committed nodes that are below the watermark.
+static void ptx_graph_retire(struct ptx_graph *graph) {
+    uint64_t watermark = ptx_graph_watermark(graph);
+    while (graph->committed.head && 
+        graph->committed.head->cseq < watermark)
+    {
+        ptx_node_retire(graph->committed.head);
+    }
+}
+
+// Perform an amount of gc work. Each root scanned, edge marked, or node swept
+// costs one unit of the budget.
+// Returns true if the cycle finished.
+static bool ptx_graph_gc0(struct ptx_graph *graph, size_t budget) {
+    ptx_graph_retire(graph);
+    if (graph->gcphase == PTX_GC_IDLE) {
+        // Start a new cycle. Nodes marked by earlier cycles are now unmarked.
+        graph->gcepoch++;
+        graph->gcphase = PTX_GC_MARK;
+        graph->gccursor = graph->head.next;
+        graph->gcstacklen = 0;
+        graph->gcfailed = false;
+    }
+    while (graph->gcphase == PTX_GC_MARK) {
+        if (budget == 0) {
+            return false;
+        }
+        if (graph->gcstacklen > 0) {
+            // Mark the nodes that a marked node points to.
+            struct ptx_node *node = graph->gcstack[--graph->gcstacklen];
+            size_t pidx = 0;
+            struct ptx_edge *edge = ptx_edgemap_iter(&node->outs, &pidx);
+            while (edge) {
+                ptx_graph_shade(graph, edge->node);
+                budget -= budget > 0;
+                edge = ptx_edgemap_iter(&node->outs, &pidx);
+            }
+        } else if (graph->gccursor != &graph->tail) {
+            // Look for roots.
+            struct ptx_node *node = graph->gccursor;
+            graph->gccursor = node->next;
+            if (ptx_node_needed(node)) {
+                ptx_graph_shade(graph, node);
+            }
+            budget--;
+        } else if (graph->gcfailed) {
+            // Out of memory. Some reachable nodes may not be marked.
+            graph->gcphase = PTX_GC_IDLE;
+            graph->gccursor = 0;
+            return true;
+        } else {
+            graph->gcphase = PTX_GC_SWEEP;
+            graph->gccursor = graph->head.next;
         }
-        node = node->next;
     }
-    // Sweep. Free unreached nodes.
-    node = graph->head.next;
-    while (node != &graph->tail) {
-        struct ptx_node *next = node->next;
-        if (!node->reached) {
+    // Sweep. Free unmarked nodes.
+    while (graph->gccursor != &graph->tail) {
+        if (budget == 0) {
+            return false;
+        }
+        struct ptx_node *node = graph->gccursor;
+        graph->gccursor = node->next;
+        if (!ptx_node_marked(node) || node->retired) {
             ptx_node_free(node);
-        } else {
-            node->reached = 0;
         }
-        node = next;
+        budget--;
     }
+    graph->gcphase = PTX_GC_IDLE;
+    graph->gccursor = 0;
+    return true;
 }
 
-static void ptx_graph_autogc(struct ptx_graph *graph) {
-    if (graph->gccounter >= graph->autogc) {
-        graph->gccounter = 0;
-        ptx_graph_gc(graph);
-    }
+void ptx_graph_gc(struct ptx_graph *graph) {
+    ptx_graph_enter_excl(graph);
+    // Abandon any cycle in progress and run a full one.
+    graph->gcphase = PTX_GC_IDLE;
+    ptx_graph_gc0(graph, SIZE_MAX);
+    // Then return the pooled memory too.
+    ptx_pool_clear(graph);
+    ptx_graph_leave(graph);
+}
+
+bool ptx_graph_gc_step(struct ptx_graph *graph, size_t budget) {
+    ptx_graph_enter_excl(graph);
+    bool done = ptx_graph_gc0(graph, budget);
+    ptx_graph_leave(graph);
+    return done;
 }
 
 struct ptx_node *ptx_graph_begin(struct ptx_graph *graph, void *opt) {
     (void)opt; // unused atm
-    struct ptx_node *node = graph->malloc(sizeof(struct ptx_node));
+    struct ptx_node *node = ptx_pool_alloc_node(graph);
     if (!node) {
         return 0;
     }
     memset(node, 0, sizeof(struct ptx_node));
-    ptx_hashset_init(&node->reads, graph->n, graph->p);
-    ptx_hashset_init(&node->writes, graph->n, graph->p);
+    ptx_hashset_init(&node->reads);
+    ptx_hashset_init(&node->writes);
+    node->reads.indexed = !graph->linearscan;
+    node->writes.indexed = !graph->linearscan;
     node->state = PTX_ACTIVE;
     node->graph = graph;
+    ptx_graph_enter(graph);
+    ptx_graph_lock(graph);
     graph->tail.prev->next = node;
     node->prev = graph->tail.prev;
     node->next = &graph->tail;
     graph->tail.prev = node;
     node->ident = ++graph->ident;
+    ptx_seqlist_push(&graph->active, node);
+    // New nodes are already marked by a gc cycle in progress.
+    node->mark = graph->gcepoch;
+    ptx_graph_unlock(graph);
+    ptx_graph_leave(graph);
     ptx_node_setlabel(node, 0);
     return node;
 }
@@ -458,47 +1642,100 @@ const char *ptx_node_label(struct ptx_node *node) {
     return node->label;
 }
 
-static void ptx_node_deactivate(struct ptx_node *node, int state) {
+// Change the state of a node. 
+// The state of a node is only changed while holding both the commit lock and
+// the node lock, allowing it to be read while holding either.
+static void ptx_node_setstate(struct ptx_node *node, int state) {
+    struct ptx_graph *graph = node->graph;
+    ptx_commit_lock(graph);
+    ptx_node_lock(graph, node);
     node->state = state;
-    if (node->graph->autogc > 0) {
-        node->graph->gccounter++;
-        if (ptx_edgemap_count(&node->outs) == 0 && !node->hasdeps) {
-            ptx_node_free(node);
+    ptx_node_unlock(graph, node);
+    ptx_commit_unlock(graph);
+}
+
+// Deactivate a node after it has been committed or rolled back.
+// Returns true if an automatic gc step is due, which the caller must run
+// after leaving the operation.
+static bool ptx_node_deactivate(struct ptx_node *node) {
+    struct ptx_graph *graph = node->graph;
+    if (node->state == PTX_ROLLEDBACK) {
+        // A rolled back node can no longer cause conflicts.
+        ptx_node_unindex(node);
+        ptx_graph_lock(graph);
+        ptx_seqlist_remove(&graph->active, node);
+        ptx_graph_unlock(graph);
+    }
+    if (graph->autogc <= 0) {
+        return false;
+    }
+    // Once a cycle is started, every deactivation moves it along a step.
+    ptx_graph_lock(graph);
+    bool gc = graph->gcphase != PTX_GC_IDLE || 
+        ++graph->gccounter >= graph->autogc;
+    if (gc) {
+        graph->gccounter = 0;
+    }
+    ptx_graph_unlock(graph);
+    if (!graph->concurrent) {
+        // Nothing can reach a node without in-edges, and a rolled back node
+        // is not needed by anything that does.
+        if ((ptx_edgemap_count(&node->ins) == 0 || 
+            node->state == PTX_ROLLEDBACK) && !ptx_node_needed(node) &&
+            !(graph->gcphase == PTX_GC_MARK && ptx_node_marked(node)))
+        {
+            ptx_node_release(node);
         }
-        ptx_graph_autogc(node->graph);
+        // The watermark may have moved.
+        ptx_graph_retire(graph);
     }
+    return gc;
 }
 
 void ptx_node_rollback(struct ptx_node *node) {
     assert(node->state == PTX_ACTIVE || node->state == PTX_NOMEM);
-    ptx_node_deactivate(node, PTX_ROLLEDBACK);
+    struct ptx_graph *graph = node->graph;
+    ptx_graph_enter(graph);
+    ptx_node_setstate(node, PTX_ROLLEDBACK);
+    bool gc = ptx_node_deactivate(node);
+    ptx_graph_leave(graph);
+    if (gc) {
+        ptx_graph_gc_step(graph, graph->gcbudget);
+    }
 }
 
 bool ptx_node_commit(struct ptx_node *node) {
     assert(node->state == PTX_ACTIVE || node->state == PTX_NOMEM);
-    if (node->state == PTX_NOMEM) {
-        _ptx_oom = true;
-        ptx_node_deactivate(node, PTX_ROLLEDBACK);
-        return false;
-    }
-    _ptx_oom = false;
-    bool abort = false;
+    struct ptx_graph *graph = node->graph;
+    ptx_graph_enter(graph);
+    _ptx_oom = node->state == PTX_NOMEM;
+    bool abort = _ptx_oom;
+    ptx_commit_lock(graph);
+    ptx_node_lock(graph, node);
     size_t pidx = 0;
     struct ptx_edge *edge = ptx_edgemap_iter(&node->outs, &pidx);
-    while (edge) {
+    while (edge && !abort) {
         if (edge->node->state == PTX_COMMITTED && edge->node->haswrites) {
             abort = true;
-            break;
         }
         edge = ptx_edgemap_iter(&node->outs, &pidx);
     }
-    if (abort) {
-        ptx_node_deactivate(node, PTX_ROLLEDBACK);
-        return false;
-    } else {
-        ptx_node_deactivate(node, PTX_COMMITTED);
-        return true;
+    node->state = abort ? PTX_ROLLEDBACK : PTX_COMMITTED;
+    ptx_node_unlock(graph, node);
+    if (!abort) {
+        ptx_graph_lock(graph);
+        node->cseq = ++graph->ident;
+        ptx_seqlist_remove(&graph->active, node);
+        ptx_seqlist_push(&graph->committed, node);
+        ptx_graph_unlock(graph);
+    }
+    ptx_commit_unlock(graph);
+    bool gc = ptx_node_deactivate(node);
+    ptx_graph_leave(graph);
+    if (gc) {
+        ptx_graph_gc_step(graph, graph->gcbudget);
     }
+    return !abort;
 }
 
 static bool ptx_edge_equal(struct ptx_edge *a, struct ptx_edge *b) {
@@ -536,7 +1773,8 @@ static bool ptx_edgemap_grow(struct ptx_graph *graph, struct ptx_edgemap *map) {
     struct ptx_edge *buckets0 = map->buckets;
     size_t nbuckets0 = map->nbuckets;
     size_t nbuckets1 = map->nbuckets == 0 ? 2 : map->nbuckets * 2;
-    struct ptx_edge *bucket1 = graph->malloc(sizeof(struct ptx_edge)*nbuckets1);
+    struct ptx_edge *bucket1 = 
+        ptx_pool_alloc(graph, sizeof(struct ptx_edge)*nbuckets1);
     if (!bucket1) {
         return false;
     }
@@ -550,7 +1788,7 @@ static bool ptx_edgemap_grow(struct ptx_graph *graph, struct ptx_edgemap *map) {
         }
     }
     if (buckets0) {
-        graph->free(buckets0);
+        ptx_pool_free(graph, buckets0, sizeof(struct ptx_edge)*nbuckets0);
     }
     return true;
 }
@@ -576,83 +1814,266 @@ static bool ptx_edgemap_add(struct ptx_edgemap *map, struct ptx_node *node,
 
 // add an edge dependency from node-a to node-b.
 static bool ptx_node_adddep(struct ptx_node *a, struct ptx_node *b, int kind) {
-#ifdef PTX_TRACKINS
-    if (!ptx_edgemap_add(&b->ins, a, kind)) {
+    struct ptx_graph *graph = a->graph;
+    bool ok = true;
+    ptx_node_lock(graph, b);
+    ok = ptx_edgemap_add(&b->ins, a, kind);
+    ptx_node_unlock(graph, b);
+    if (!ok) {
         return false;
     }
-#endif
-    if (!ptx_edgemap_add(&a->outs, b, kind)) {
+    ptx_node_lock(graph, a);
+    ok = ptx_edgemap_add(&a->outs, b, kind);
+    ptx_node_unlock(graph, a);
+    if (!ok) {
         return false;
     }
+    if (graph->gcphase == PTX_GC_MARK) {
+        // A marked node must not point to an unmarked node at the end of the
+        // mark phase.
+        ptx_graph_lock(graph);
+        if (ptx_node_marked(a)) {
+            ptx_graph_shade(graph, b);
+        }
+        ptx_graph_unlock(graph);
+    }
+    ptx_node_lock(graph, b);
     b->hasdeps = true;
+    ptx_node_unlock(graph, b);
     return true;
 }
 
-void ptx_node_read(struct ptx_node *node, uint64_t hash) {
-    // The node can only be in ACTIVE or NOMEM state
-    assert(node->state == PTX_ACTIVE || node->state == PTX_NOMEM);
-    if (node->state == PTX_NOMEM) {
-        return;
+// Returns true if the node is able to cause conflicts for other nodes.
+// Rolled back nodes and nodes that are out of memory are not, and these are
+// never in the conflict index.
+static bool ptx_node_conflictable(struct ptx_node *node) {
+    return (node->state == PTX_ACTIVE || node->state == PTX_COMMITTED) &&
+        !node->retired;
+}
+
+static void ptx_node_nomem(struct ptx_node *node) {
+    ptx_node_setstate(node, PTX_NOMEM);
+    ptx_node_unindex(node);
+}
+
+// Test another node's set for any of the hashes.
+// Only sets that are not in the conflict index are tested, unless the graph
+// uses a linear scan.
+static bool ptx_node_test(struct ptx_node *node, struct ptx_hashset *set,
+    const uint64_t *hashes, size_t n)
+{
+    struct ptx_graph *graph = node->graph;
+    ptx_node_lock(graph, node);
+    bool hit = false;
+    if (graph->linearscan) {
+        hit = ptx_node_conflictable(node) && 
+            ptx_hashset_testmany(set, hashes, n);
+    } else if (!set->indexed) {
+        hit = ptx_hashset_testmany(set, hashes, n);
     }
-    // Add the read to the current node
-    if (!ptx_hashset_add(node->graph, &node->reads, hash)) {
-        node->state = PTX_NOMEM;
-        return;
+    ptx_node_unlock(graph, node);
+    return hit;
+}
+
+// A small direct-mapped cache of the nodes that a batch of hashes has already
+// found in the conflict index. This avoids adding the same edge for each
+// hash in the batch.
+struct ptx_seen {
+    struct ptx_node *nodes[64];
+};
+
+// Returns false if the node was already seen.
+static bool ptx_seen_add(struct ptx_seen *seen, struct ptx_node *node) {
+    size_t i = node->ident & 63;
+    if (seen->nodes[i] == node) {
+        return false;
+    }
+    seen->nodes[i] = node;
+    return true;
+}
+
+// Search the graph for nodes that have written the same hashes.
+// Each other node is visited once for the entire batch of hashes.
+// Return true on Success, or false on Out of memory.
+static bool ptx_node_findwriters(struct ptx_node *node, const uint64_t *hashes,
+    size_t n)
+{
+    struct ptx_graph *graph = node->graph;
+    bool ok = true;
+    if (graph->linearscan) {
+        ptx_graph_lock(graph);
+        struct ptx_node *other = graph->head.next;
+        while (ok && other != &graph->tail) {
+            if (other != node && 
+                ptx_node_test(other, &other->writes, hashes, n))
+            {
+                ok = ptx_node_adddep(other, node, PTX_WR);
+            }
+            other = other->next;
+        }
+        ptx_graph_unlock(graph);
+        return ok;
+    }
+    struct ptx_seen seen = { 0 };
+    struct ptx_node *other;
+    for (size_t i = 0; ok && i < n; i++) {
+        struct ptx_index *index = ptx_graph_index(graph, true, hashes[i]);
+        ptx_index_lock(graph, index);
+        struct ptx_index_iter iter = ptx_index_iter(index, hashes[i]);
+        other = ptx_index_next(index, &iter);
+        while (ok && other) {
+            if (other != node && ptx_seen_add(&seen, other)) {
+                ok = ptx_node_adddep(other, node, PTX_WR);
+            }
+            other = ptx_index_next(index, &iter);
+        }
+        ptx_index_unlock(graph, index);
+    }
+    ptx_blooms_lock(graph, false);
+    for (size_t i = 0; ok && i < graph->nblooms; i++) {
+        other = graph->blooms[i];
+        if (other != node && ptx_node_test(other, &other->writes, hashes, n)) {
+            ok = ptx_node_adddep(other, node, PTX_WR);
+        }
     }
-    node->hasreads = true;
-    // Search for nodes that have written the same hash
-    struct ptx_node *other = node->graph->head.next;
-    while (other != &node->graph->tail) {
-        if (other != node) {
-            if (ptx_hashset_test(&other->writes, hash)) {
-                if (!ptx_node_adddep(other, node, PTX_WR)) {
-                    node->state = PTX_NOMEM;
-                    return;
+    ptx_blooms_unlock(graph);
+    return ok;
+}
+
+// Add the write-write dependencies between two nodes.
+static bool ptx_node_addww(struct ptx_node *a, struct ptx_node *b) {
+    return ptx_node_adddep(a, b, PTX_WW) && ptx_node_adddep(b, a, PTX_WW);
+}
+
+// Search the graph for nodes that have read or written the same hashes.
+// Each other node is visited once for the entire batch of hashes.
+// Return true on Success, or false on Out of memory.
+static bool ptx_node_findaccessors(struct ptx_node *node, 
+    const uint64_t *hashes, size_t n)
+{
+    struct ptx_graph *graph = node->graph;
+    bool ok = true;
+    if (graph->linearscan) {
+        ptx_graph_lock(graph);
+        struct ptx_node *other = graph->head.next;
+        while (ok && other != &graph->tail) {
+            if (other != node) {
+                if (ptx_node_test(other, &other->reads, hashes, n)) {
+                    ok = ptx_node_adddep(other, node, PTX_RW);
                 }
+                if (ok && ptx_node_test(other, &other->writes, hashes, n)) {
+                    ok = ptx_node_addww(other, node);
+                }
+            }
+            other = other->next;
+        }
+        ptx_graph_unlock(graph);
+        return ok;
+    }
+    struct ptx_seen rseen = { 0 };
+    struct ptx_seen wseen = { 0 };
+    struct ptx_node *other;
+    for (size_t i = 0; ok && i < n; i++) {
+        struct ptx_index *index = ptx_graph_index(graph, false, hashes[i]);
+        ptx_index_lock(graph, index);
+        struct ptx_index_iter iter = ptx_index_iter(index, hashes[i]);
+        other = ptx_index_next(index, &iter);
+        while (ok && other) {
+            if (other != node && ptx_seen_add(&rseen, other)) {
+                ok = ptx_node_adddep(other, node, PTX_RW);
             }
+            other = ptx_index_next(index, &iter);
+        }
+        ptx_index_unlock(graph, index);
+        index = ptx_graph_index(graph, true, hashes[i]);
+        ptx_index_lock(graph, index);
+        iter = ptx_index_iter(index, hashes[i]);
+        other = ptx_index_next(index, &iter);
+        while (ok && other) {
+            if (other != node && ptx_seen_add(&wseen, other)) {
+                ok = ptx_node_addww(other, node);
+            }
+            other = ptx_index_next(index, &iter);
+        }
+        ptx_index_unlock(graph, index);
+    }
+    ptx_blooms_lock(graph, false);
+    for (size_t i = 0; ok && i < graph->nblooms; i++) {
+        other = graph->blooms[i];
+        if (other == node) {
+            continue;
+        }
+        if (ptx_node_test(other, &other->reads, hashes, n)) {
+            ok = ptx_node_adddep(other, node, PTX_RW);
+        }
+        if (ok && ptx_node_test(other, &other->writes, hashes, n)) {
+            ok = ptx_node_addww(other, node);
         }
-        other = other->next;
     }
+    ptx_blooms_unlock(graph);
+    return ok;
 }
 
-void ptx_node_write(struct ptx_node *node, uint64_t hash) {
+void ptx_node_read_many(struct ptx_node *node, const uint64_t *hashes,
+    size_t n)
+{
     // The node can only be in ACTIVE or NOMEM state
     assert(node->state == PTX_ACTIVE || node->state == PTX_NOMEM);
-    if (node->state == PTX_NOMEM) {
+    if (node->state == PTX_NOMEM || n == 0) {
         return;
     }
-    // Add the write to the current node
-    if (!ptx_hashset_add(node->graph, &node->writes, hash)) {
-        node->state = PTX_NOMEM;
+    struct ptx_graph *graph = node->graph;
+    ptx_graph_enter(graph);
+    // Add the reads to the current node
+    bool ok = true;
+    for (size_t i = 0; ok && i < n; i++) {
+        ok = ptx_node_record(node, &node->reads, false, hashes[i]);
+    }
+    if (ok) {
+        node->hasreads = true;
+        ok = ptx_node_findwriters(node, hashes, n);
+    }
+    if (!ok) {
+        ptx_node_nomem(node);
+    }
+    ptx_graph_leave(graph);
+}
+
+void ptx_node_write_many(struct ptx_node *node, const uint64_t *hashes,
+    size_t n)
+{
+    // The node can only be in ACTIVE or NOMEM state
+    assert(node->state == PTX_ACTIVE || node->state == PTX_NOMEM);
+    if (node->state == PTX_NOMEM || n == 0) {
         return;
     }
-    node->haswrites = true;
-    // Search for nodes that have read or written the same hash.
-    struct ptx_node *other = node->graph->head.next;
-    while (other != &node->graph->tail) {
-        if (other != node) {
-            if (ptx_hashset_test(&other->reads, hash)) {
-                if (!ptx_node_adddep(other, node, PTX_RW)) {
-                    node->state = PTX_NOMEM;
-                    return;
-                }
-            }
-            if (ptx_hashset_test(&other->writes, hash)) {
-                if (!ptx_node_adddep(other, node, PTX_WW)) {
-                    node->state = PTX_NOMEM;
-                    return;
-                }
-                if (!ptx_node_adddep(node, other, PTX_WW)) {
-                    node->state = PTX_NOMEM;
-                    return;
-                }
-            }
-        }
-        other = other->next;
+    struct ptx_graph *graph = node->graph;
+    ptx_graph_enter(graph);
+    // Add the writes to the current node
+    bool ok = true;
+    for (size_t i = 0; ok && i < n; i++) {
+        ok = ptx_node_record(node, &node->writes, true, hashes[i]);
+    }
+    if (ok) {
+        node->haswrites = true;
+        ok = ptx_node_findaccessors(node, hashes, n);
     }
+    if (!ok) {
+        ptx_node_nomem(node);
+    }
+    ptx_graph_leave(graph);
+}
+
+void ptx_node_read(struct ptx_node *node, uint64_t hash) {
+    ptx_node_read_many(node, &hash, 1);
+}
+
+void ptx_node_write(struct ptx_node *node, uint64_t hash) {
+    ptx_node_write_many(node, &hash, 1);
 }
 
 void ptx_graph_print(struct ptx_graph *graph, bool withedges) {
+    ptx_graph_enter_excl(graph);
     struct ptx_node *node = graph->head.next;
     char T1[32];
     char T2[32];
@@ -666,11 +2087,7 @@ void ptx_graph_print(struct ptx_graph *graph, bool withedges) {
         } else if (node->state == PTX_ROLLEDBACK) {
             printf(" \033[1;31mROLLBACK\033[m ");
         }
-#ifdef PTX_TRACKINS
         printf("(%d ins, %d outs)", (int)ptx_edgemap_count(&node->ins),
-#else
-        printf("(%d outs)", 
-#endif
             (int)ptx_edgemap_count(&node->outs));
         if (ptx_hashset_empty(&node->writes)) {
             printf(" \033[2m<READONLY>\033[m");
@@ -696,7 +2113,6 @@ void ptx_graph_print(struct ptx_graph *graph, bool withedges) {
                 edge = ptx_edgemap_iter(&node->outs, &pidx);
             }
             printf("\033[m");
-#ifdef PTX_TRACKINS
             printf("\033[2m\033[1;30m");
             pidx = 0;
             edge = ptx_edgemap_iter(&node->ins, &pidx);
@@ -714,10 +2130,10 @@ void ptx_graph_print(struct ptx_graph *graph, bool withedges) {
                 edge = ptx_edgemap_iter(&node->ins, &pidx);
             }
             printf("\033[m");
-#endif
         }
         node = node->next;
     }
+    ptx_graph_leave(graph);
 }
 
 static const char *ptx_strstate(int status) {
@@ -735,6 +2151,7 @@ void ptx_graph_print_state(struct ptx_graph *graph, char output[]) {
     int i = 0;
     char buf[128] = "";
     output[0] = 0;
+    ptx_graph_enter_excl(graph);
     struct ptx_node *node = graph->head.next;
     while (node != &graph->tail) {
         if (i > 0) {
@@ -746,4 +2163,5 @@ void ptx_graph_print_state(struct ptx_graph *graph, char output[]) {
         node = node->next;
         i++;
     }
+    ptx_graph_leave(graph);
 }
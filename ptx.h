@@ -20,6 +20,11 @@ struct ptx_graph_opts {
     size_t n;   // bloom filter: number of elements (default 1,000,000)
     double p;   // bloom filter: false positive rate (default 1%)
     int autogc; // automatic gc cycle, set -1 to disable. (default: 1000)
+    int gcbudget; // work per automatic gc step (default: 256)
+    size_t poolsize; // bytes of freed memory kept for reuse (default: 16 MB)
+    bool linearscan; // scan every node instead of using the conflict index
+    bool blocked;    // use cache-line blocked bloom filters (default: false)
+    bool concurrent; // allow operations from many threads (default: false)
 };
 
 // Create a new graph.
@@ -39,6 +44,16 @@ void ptx_node_read(struct ptx_node *node, uint64_t hash);
 // Write an item using the item's hash
 void ptx_node_write(struct ptx_node *node, uint64_t hash);
 
+// Read many items at once using the items' hashes.
+// Same as calling ptx_node_read() for each hash, but faster.
+void ptx_node_read_many(struct ptx_node *node, const uint64_t *hashes,
+    size_t n);
+
+// Write many items at once using the items' hashes.
+// Same as calling ptx_node_write() for each hash, but faster.
+void ptx_node_write_many(struct ptx_node *node, const uint64_t *hashes,
+    size_t n);
+
 // Rollback a transaction
 // The transaction node should not be used again after this call.
 void ptx_node_rollback(struct ptx_node *node);
@@ -59,7 +74,12 @@ const char *ptx_node_label(struct ptx_node *node);
 // Debug: print the entire graph to stdout
 void ptx_graph_print(struct ptx_graph *graph, bool withedges);
 
-// Debug: call a garbage collection cycle now
+// Debug: call a garbage collection cycle now, and return any memory that the
+// graph keeps for reuse back to the allocator.
 void ptx_graph_gc(struct ptx_graph *graph);
 
+// Perform a bounded amount of garbage collection work, such as during idle
+// time. Returns true when a collection cycle finished.
+bool ptx_graph_gc_step(struct ptx_graph *graph, size_t budget);
+
 #endif
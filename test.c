@@ -1,11 +1,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 #include "ptx.h"
 
 void ptx_graph_print_state(struct ptx_graph *graph, char output[]);
 
 static size_t _nallocs = 0;
+static size_t _nmallocs = 0; // total calls to xmalloc
 
 static size_t xallocs(void) {
     return _nallocs;
@@ -15,6 +18,7 @@ static void *xmalloc(size_t size) {
     void *ptr = malloc(size); 
     assert(ptr);
     _nallocs++;
+    _nmallocs++;
     return ptr;
 }
 
@@ -37,6 +41,418 @@ static uint64_t strhash(const char *str) {
     return th64(str, strlen(str), 0);
 }
 
+static uint64_t rand_next(uint64_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+// Run the same random workload against a graph that uses the conflict index
+// and a graph that uses a linear scan. Both must make the same decisions.
+static void test_index_parity(void) {
+    printf("========================\n");
+    printf("===   index-parity   ===\n");
+    printf("========================\n");
+    struct ptx_graph_opts opts = {
+        .malloc = xmalloc,
+        .free = xfree,
+        .n = 256,
+        .autogc = -1,
+    };
+    struct ptx_graph *g1 = ptx_graph_new(&opts);
+    opts.linearscan = true;
+    struct ptx_graph *g2 = ptx_graph_new(&opts);
+    struct ptx_node *t1[16] = { 0 };
+    struct ptx_node *t2[16] = { 0 };
+    uint64_t seed = 1;
+    int ncommits = 0;
+    for (int i = 0; i < 20000; i++) {
+        int x = rand_next(&seed) % 16;
+        int op = rand_next(&seed) % 100;
+        // Mostly small key spaces, with the occasional very large transaction
+        // to push sets over to bloom filter mode.
+        uint64_t nkeys = x == 0 ? 100000 : 64;
+        uint64_t hash = th64(&(uint64_t){rand_next(&seed)%nkeys}, 8, 0);
+        if (!t1[x]) {
+            t1[x] = ptx_graph_begin(g1, 0);
+            t2[x] = ptx_graph_begin(g2, 0);
+        } else if (op < 45) {
+            ptx_node_read(t1[x], hash);
+            ptx_node_read(t2[x], hash);
+        } else if (op < 90) {
+            ptx_node_write(t1[x], hash);
+            ptx_node_write(t2[x], hash);
+        } else if (op < 97 || x == 0) {
+            bool ok1 = ptx_node_commit(t1[x]);
+            bool ok2 = ptx_node_commit(t2[x]);
+            assert(ok1 == ok2);
+            ncommits += ok1;
+            t1[x] = t2[x] = 0;
+        } else {
+            ptx_node_rollback(t1[x]);
+            ptx_node_rollback(t2[x]);
+            t1[x] = t2[x] = 0;
+        }
+        if (i % 1000 == 999) {
+            ptx_graph_gc(g1);
+            ptx_graph_gc(g2);
+        }
+    }
+    for (int x = 0; x < 16; x++) {
+        if (t1[x]) {
+            ptx_node_rollback(t1[x]);
+            ptx_node_rollback(t2[x]);
+        }
+    }
+    printf("%d commits\n\n", ncommits);
+    ptx_graph_free(g1);
+    ptx_graph_free(g2);
+}
+
+// Run the same workload through one graph that reads and writes one hash at
+// a time, and through two graphs that use the batch operations. All must
+// agree on every commit.
+static void test_batch_parity(void) {
+    printf("========================\n");
+    printf("===   batch-parity   ===\n");
+    printf("========================\n");
+    struct ptx_graph_opts opts = {
+        .malloc = xmalloc,
+        .free = xfree,
+        .n = 256,
+        .autogc = -1,
+    };
+    struct ptx_graph *g1 = ptx_graph_new(&opts);
+    struct ptx_graph *g2 = ptx_graph_new(&opts);
+    opts.linearscan = true;
+    struct ptx_graph *g3 = ptx_graph_new(&opts);
+    struct ptx_node *t1[16] = { 0 };
+    struct ptx_node *t2[16] = { 0 };
+    struct ptx_node *t3[16] = { 0 };
+    uint64_t hashes[32];
+    uint64_t seed = 2;
+    int ncommits = 0;
+    for (int i = 0; i < 5000; i++) {
+        int x = rand_next(&seed) % 16;
+        int op = rand_next(&seed) % 100;
+        uint64_t nkeys = x == 0 ? 100000 : 256;
+        size_t n = rand_next(&seed) % 32;
+        for (size_t j = 0; j < n; j++) {
+            hashes[j] = th64(&(uint64_t){rand_next(&seed)%nkeys}, 8, 0);
+        }
+        if (!t1[x]) {
+            t1[x] = ptx_graph_begin(g1, 0);
+            t2[x] = ptx_graph_begin(g2, 0);
+            t3[x] = ptx_graph_begin(g3, 0);
+        } else if (op < 45) {
+            for (size_t j = 0; j < n; j++) {
+                ptx_node_read(t1[x], hashes[j]);
+            }
+            ptx_node_read_many(t2[x], hashes, n);
+            ptx_node_read_many(t3[x], hashes, n);
+        } else if (op < 90) {
+            for (size_t j = 0; j < n; j++) {
+                ptx_node_write(t1[x], hashes[j]);
+            }
+            ptx_node_write_many(t2[x], hashes, n);
+            ptx_node_write_many(t3[x], hashes, n);
+        } else {
+            bool ok1 = ptx_node_commit(t1[x]);
+            bool ok2 = ptx_node_commit(t2[x]);
+            bool ok3 = ptx_node_commit(t3[x]);
+            assert(ok1 == ok2 && ok1 == ok3);
+            ncommits += ok1;
+            t1[x] = t2[x] = t3[x] = 0;
+        }
+        if (i % 500 == 499) {
+            ptx_graph_gc(g1);
+            ptx_graph_gc(g2);
+            ptx_graph_gc(g3);
+        }
+    }
+    for (int x = 0; x < 16; x++) {
+        if (t1[x]) {
+            ptx_node_rollback(t1[x]);
+            ptx_node_rollback(t2[x]);
+            ptx_node_rollback(t3[x]);
+        }
+    }
+    printf("%d commits\n\n", ncommits);
+    ptx_graph_free(g1);
+    ptx_graph_free(g2);
+    ptx_graph_free(g3);
+}
+
+// Measure the false positive rate of a transaction that has upgraded to a
+// bloom filter. Each trial writes a key that the bloom filter transaction
+// never touched, which fails to commit only when the filter gives a false
+// positive. The rate must hold even when the transaction touches many more
+// keys than the graph's n option.
+static void test_bloom_fpr(bool blocked, int N) {
+    printf("========================\n");
+    printf("===   bloom-fpr-%d    ===\n", blocked);
+    printf("========================\n");
+    double P = 0.01;
+    struct ptx_graph_opts opts = {
+        .malloc = xmalloc,
+        .free = xfree,
+        .n = 1000,
+        .p = P,
+        .autogc = -1,
+        .blocked = blocked,
+    };
+    struct ptx_graph *graph = ptx_graph_new(&opts);
+    struct ptx_node *T1 = ptx_graph_begin(graph, 0);
+    for (int i = 0; i < N; i++) {
+        ptx_node_write(T1, th64(&i, sizeof(int), 1));
+    }
+    assert(ptx_node_commit(T1));
+    int ntrials = 20000;
+    int nfails = 0;
+    for (int i = 0; i < ntrials; i++) {
+        struct ptx_node *T2 = ptx_graph_begin(graph, 0);
+        ptx_node_write(T2, th64(&i, sizeof(int), 2));
+        nfails += !ptx_node_commit(T2);
+    }
+    double fpr = (double)nfails / ntrials;
+    printf("%.4f false positive rate\n\n", fpr);
+    assert(fpr > 0 && fpr < P * 1.5);
+    ptx_graph_free(graph);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+struct stress_ctx {
+    struct ptx_graph *graph;
+    pthread_mutex_t *mu;
+    uint64_t *versions;
+    int nkeys;
+    int ntxs;
+    int seed;
+    int commits;
+};
+
+// Each transaction reads a few keys and then increments a versioned key.
+// A transaction that commits must never have missed another transaction's
+// increment, otherwise an update was lost.
+static void *stress_thread(void *arg) {
+    struct stress_ctx *ctx = arg;
+    uint64_t seed = ctx->seed;
+    for (int i = 0; i < ctx->ntxs; i++) {
+        struct ptx_node *T = ptx_graph_begin(ctx->graph, 0);
+        assert(T);
+        for (int j = 0; j < 4; j++) {
+            int key = rand_next(&seed) % ctx->nkeys;
+            ptx_node_read(T, th64(&key, sizeof(int), 0));
+        }
+        int key = rand_next(&seed) % ctx->nkeys;
+        uint64_t hash = th64(&key, sizeof(int), 0);
+        ptx_node_read(T, hash);
+        uint64_t v = __atomic_load_n(&ctx->versions[key], __ATOMIC_SEQ_CST);
+        ptx_node_write(T, hash);
+        pthread_mutex_lock(ctx->mu);
+        if (ptx_node_commit(T)) {
+            assert(__atomic_compare_exchange_n(&ctx->versions[key], &v, v+1,
+                false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+            ctx->commits++;
+        }
+        pthread_mutex_unlock(ctx->mu);
+    }
+    return 0;
+}
+
+// Exercise the incremental garbage collector.
+static void test_gc(void) {
+    printf("========================\n");
+    printf("===        gc        ===\n");
+    printf("========================\n");
+    size_t nallocs = xallocs();
+    struct ptx_graph_opts opts = {
+        .malloc = xmalloc,
+        .free = xfree,
+        .autogc = -1,
+        .poolsize = 1, // nothing is kept for reuse, so frees can be counted
+    };
+    // A long chain of rolled back nodes that is kept alive by an active
+    // node at its head must not overflow the stack while marking.
+    int N = 200000;
+    struct ptx_graph *graph = ptx_graph_new(&opts);
+    struct ptx_node *head = ptx_graph_begin(graph, 0);
+    struct ptx_node *prev = head;
+    ptx_node_write(head, 0);
+    for (uint64_t i = 1; i <= (uint64_t)N; i++) {
+        struct ptx_node *T = ptx_graph_begin(graph, 0);
+        ptx_node_write(T, i-1);
+        ptx_node_write(T, i);
+        if (prev != head) {
+            ptx_node_rollback(prev);
+        }
+        prev = T;
+    }
+    ptx_graph_gc(graph);
+    ptx_node_rollback(prev);
+    ptx_node_rollback(head);
+    // Now everything is garbage. Collect it in small steps.
+    int steps = 1;
+    while (!ptx_graph_gc_step(graph, 1000)) {
+        steps++;
+    }
+    assert(steps > N/1000);
+    // Only the graph and its mark stack remain.
+    assert(xallocs() == nallocs + 2);
+    ptx_graph_free(graph);
+    assert(xallocs() == nallocs);
+    printf("%d steps\n", steps);
+
+    // Nodes that can no longer be reached are freed right away when the
+    // automatic gc is enabled.
+    opts.autogc = 1000;
+    graph = ptx_graph_new(&opts);
+    nallocs = xallocs();
+    struct ptx_node *T1 = ptx_graph_begin(graph, 0);
+    ptx_node_write(T1, 1);
+    struct ptx_node *T2 = ptx_graph_begin(graph, 0);
+    ptx_node_read(T2, 1);
+    ptx_node_rollback(T2);
+    assert(xallocs() > nallocs);
+    assert(ptx_node_commit(T1));
+    assert(xallocs() == nallocs);
+    ptx_graph_free(graph);
+
+    // Random workload with an automatic gc that runs in tiny steps, which
+    // keeps a cycle in progress while the graph changes.
+    opts.autogc = 16;
+    opts.gcbudget = 4;
+    nallocs = xallocs();
+    graph = ptx_graph_new(&opts);
+    struct ptx_node *txs[16] = { 0 };
+    uint64_t seed = 3;
+    int ncommits = 0;
+    for (int i = 0; i < 50000; i++) {
+        int x = rand_next(&seed) % 16;
+        int op = rand_next(&seed) % 100;
+        uint64_t hash = rand_next(&seed) % 64;
+        if (!txs[x]) {
+            txs[x] = ptx_graph_begin(graph, 0);
+        } else if (op < 45) {
+            ptx_node_read(txs[x], hash);
+        } else if (op < 90) {
+            ptx_node_write(txs[x], hash);
+        } else if (op < 97) {
+            ncommits += ptx_node_commit(txs[x]);
+            txs[x] = 0;
+        } else {
+            ptx_node_rollback(txs[x]);
+            txs[x] = 0;
+        }
+    }
+    for (int x = 0; x < 16; x++) {
+        if (txs[x]) {
+            ptx_node_rollback(txs[x]);
+        }
+    }
+    ptx_graph_free(graph);
+    assert(xallocs() == nallocs);
+    printf("%d commits\n\n", ncommits);
+}
+
+// Once a workload reaches a steady state the graph should reuse its own
+// memory, without calling malloc.
+static void test_pool(void) {
+    printf("========================\n");
+    printf("===       pool       ===\n");
+    printf("========================\n");
+    struct ptx_graph_opts opts = {
+        .malloc = xmalloc,
+        .free = xfree,
+        .n = 1000,
+    };
+    struct ptx_graph *graph = ptx_graph_new(&opts);
+    struct ptx_node *txs[8] = { 0 };
+    uint64_t seed = 4;
+    size_t nmallocs = 0;
+    int ncommits = 0;
+    for (int i = 0; i < 40000; i++) {
+        if (i == 20000) {
+            nmallocs = _nmallocs;
+        }
+        int x = i % 8;
+        if (txs[x]) {
+            ncommits += ptx_node_commit(txs[x]);
+        }
+        txs[x] = ptx_graph_begin(graph, 0);
+        // Mostly small transactions, and sometimes one that upgrades to a
+        // bloom filter.
+        int nkeys = rand_next(&seed) % 100 == 0 ? 2000 : 8;
+        for (int j = 0; j < nkeys; j++) {
+            uint64_t hash = th64(&(uint64_t){rand_next(&seed)%100000}, 8, 0);
+            if (j % 2) {
+                ptx_node_write(txs[x], hash);
+            } else {
+                ptx_node_read(txs[x], hash);
+            }
+        }
+    }
+    printf("%zu mallocs during the last 20000 transactions\n", 
+        _nmallocs - nmallocs);
+    assert(_nmallocs == nmallocs);
+    for (int x = 0; x < 8; x++) {
+        ptx_node_rollback(txs[x]);
+    }
+    ptx_graph_free(graph);
+    printf("%d commits\n\n", ncommits);
+}
+
+// Run many threads at once against a concurrent graph.
+static void test_concurrent(void) {
+    printf("========================\n");
+    printf("===    concurrent    ===\n");
+    printf("========================\n");
+    int nkeys = 10000;
+    uint64_t *versions = xmalloc(nkeys * sizeof(uint64_t));
+    for (int nthreads = 1; nthreads <= 8; nthreads *= 2) {
+        struct ptx_graph_opts opts = { .concurrent = true, .autogc = -1 };
+        struct ptx_graph *graph = ptx_graph_new(&opts);
+        pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+        memset(versions, 0, nkeys * sizeof(uint64_t));
+        struct stress_ctx ctxs[8];
+        pthread_t threads[8];
+        double start = now();
+        for (int i = 0; i < nthreads; i++) {
+            ctxs[i] = (struct stress_ctx) {
+                .graph = graph,
+                .mu = &mu,
+                .versions = versions,
+                .nkeys = nkeys,
+                .ntxs = 2000,
+                .seed = i + 1,
+            };
+            pthread_create(&threads[i], 0, stress_thread, &ctxs[i]);
+        }
+        int commits = 0;
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], 0);
+            commits += ctxs[i].commits;
+        }
+        double elapsed = now() - start;
+        uint64_t total = 0;
+        for (int i = 0; i < nkeys; i++) {
+            total += versions[i];
+        }
+        assert(total == (uint64_t)commits);
+        printf("%d threads: %d/%d commits, %.0f txs/sec\n", nthreads, commits,
+            nthreads * 2000, nthreads * 2000 / elapsed);
+        ptx_graph_free(graph);
+    }
+    printf("\n");
+    xfree(versions);
+}
+
 int main(void) {
     int N = 1000000;
     struct ptx_graph_opts opts = {
@@ -204,6 +620,16 @@ TXDO("write-read", 1, {
     xfree(txs);
     ptx_graph_free(graph);
 
+    test_index_parity();
+    test_batch_parity();
+    test_bloom_fpr(false, 20000);
+    test_bloom_fpr(true, 20000);
+    test_bloom_fpr(false, 200000);
+    test_bloom_fpr(true, 200000);
+    test_gc();
+    test_pool();
+    test_concurrent();
+
     if (xallocs() != 0) {
         printf("%zu remaining allocations\n", xallocs());
         printf("FAIL\n");